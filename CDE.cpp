@@ -6,6 +6,8 @@
 //
 
 #include "CDE.h"
+#include "CDECurve.h"
+#include "CDEUtils.h"
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
@@ -25,7 +27,7 @@ namespace {
 
     // A simple plotting function, for the ease of visualizing vectors and debugging
     template <int N>
-    inline void plot(cv::Vec<float, N> &vec, const char* win_name) {
+    inline void plot(const cv::Vec<float, N> &vec, const char* win_name) {
         std::vector<float> pvec;
         for (int i = 0; i < N; i++)
             pvec.push_back(vec[i]);
@@ -42,6 +44,8 @@ namespace {
     const double PI = 3.141592653589793;
     const double kGaussianConstant = 1.0/std::sqrt(2*PI);
     const int kNumNeighbors = 8;
+    const int kMinPreviewSide = 64;
+    const int kCancelCheckRows = 32;
     typedef vector<const ContrastPair *> ContrastPairSet;
 
     inline CDE_Vec_f identity() {
@@ -57,21 +61,26 @@ namespace {
         return std::exp(-(u-x)*(u-x)/(sigma*sigma/4));
     }
 
-    inline CDE_Vec_f accumulatePairs(const std::vector<const ContrastPair *> &pairs) {
+    // Same as summing p->getVector(), but touches only the span of each pair,
+    // so that the cost shrinks with the number of intensity levels.
+    inline CDE_Vec_i accumulatePairs(const std::vector<const ContrastPair *> &pairs) {
         CDE_Vec_i f = CDE_Vec_i::all(0);
         for (const ContrastPair* p : pairs)
-            f += p->getVector();
+            for (uint k = p->getLow(); k <= p->getHigh(); k++)
+                f[k]++;
         return f;
     }
 
-    CDE_Vec_f generateTransformFunc(const std::vector<const ContrastPair *> &pairs) {
+    CDE_Vec_f generateTransformFunc(const std::vector<const ContrastPair *> &pairs, int levels) {
         assert(pairs.size() > 0);
 
         CDE_Vec_i f = accumulatePairs(pairs);
-        CDE_Vec_f F = CDE_Vec_f::all(0.f);
-        float total_votes = (float)sum(cv::Mat(f))[0];
+        CDE_Vec_f F = CDE_Vec_f::all(1.f);
+        float total_votes = 0;
+        for (int k = 0; k < levels; k++)
+            total_votes += f[k];
         float sum = 0;
-        for (uint k = 0; k <= kMaxIntensity; k++) {
+        for (int k = 0; k < levels; k++) {
             sum += f[k];
             F[k] = sum / total_votes;
         }
@@ -79,11 +88,22 @@ namespace {
         return F;
     }
 
-    void generateContrastPairs(const Mat &img, vector<ContrastPair> &pairs, vector<ContrastPairSet> &pairs_of_pixels) {
+    inline bool isCancelled(const std::atomic<bool> *cancel, int row) {
+        return cancel && row % kCancelCheckRows == 0 && *cancel;
+    }
+
+    // Pair values are quantised to levels of `step` intensities as they are read.
+    // Returns false if cancelled, checked every kCancelCheckRows rows.
+    bool generateContrastPairs(const Mat &img, int step, vector<ContrastPair> &pairs, vector<ContrastPairSet> &pairs_of_pixels,
+                               const std::atomic<bool> *cancel) {
         assert(img.channels() == 1);
         int H = img.rows;
         int W = img.cols;
 
+        Intensity level[kMaxIntensity+1];
+        for (int v = 0; v <= kMaxIntensity; v++)
+            level[v] = (Intensity)(v / step);
+
         // indexing of neighbor pairs
         // 1 2 3
         // 0 * 4
@@ -94,6 +114,8 @@ namespace {
 
         int idx;
         for (int i = 0; i < H; i++) {
+            if (isCancelled(cancel, i))
+                return false;
             for (int j = 0; j < W; j++) {
                 idx = i*W + j;
                 pairs_of_pixels.push_back(ContrastPairSet(8, &CDE::noneContrast));
@@ -116,40 +138,114 @@ namespace {
 
                 // set neighbor 4
                 if (j < W-1) {
-                    pairs.push_back(ContrastPair(img.at<uchar>(i, j), img.at<uchar>(i, j+1)));
+                    pairs.push_back(ContrastPair(level[img.at<uchar>(i, j)], level[img.at<uchar>(i, j+1)]));
                     pairs_of_pixels.at(idx).at(4) = &pairs.back();
                 }
 
                 // set neighbor 5
                 if (i < H-1 && j < W-1) {
-                    pairs.push_back(ContrastPair(img.at<uchar>(i, j), img.at<uchar>(i+1, j+1)));
+                    pairs.push_back(ContrastPair(level[img.at<uchar>(i, j)], level[img.at<uchar>(i+1, j+1)]));
                     pairs_of_pixels.at(idx).at(5) = &pairs.back();
                 }
 
                 // set neighbor 6
                 if (i < H-1) {
-                    pairs.push_back(ContrastPair(img.at<uchar>(i, j), img.at<uchar>(i+1, j)));
+                    pairs.push_back(ContrastPair(level[img.at<uchar>(i, j)], level[img.at<uchar>(i+1, j)]));
                     pairs_of_pixels.at(idx).at(6) = &pairs.back();
                 }
 
                 // set neighbor 7
                 if (j > 0 && i < H-1) {
-                    pairs.push_back(ContrastPair(img.at<uchar>(i, j), img.at<uchar>(i+1, j-1)));
+                    pairs.push_back(ContrastPair(level[img.at<uchar>(i, j)], level[img.at<uchar>(i+1, j-1)]));
                     pairs_of_pixels.at(idx).at(7) = &pairs.back();
                 }
             }
         }
+        return true;
     }
 
-    void applyTransform(Mat &src, Mat &dst, const CDE_Vec_f &transform_func) {
-        assert(src.type() == CV_8UC1);
-
-        dst = Mat(src.size(), CV_8UC1);
-        for (int i = 0; i < src.rows; i++) {
-            for (int j = 0; j < src.cols; j++) {
-                dst.at<uchar>(i, j) = (uchar)std::round(transform_func[src.at<uchar>(i, j)] * kMaxIntensity);
+    // Histogram of V = max(B, G, R), the value channel of CV_BGR2HSV_FULL, over
+    // every step-th row and column. Avoids converting the whole image.
+    CDE_Vec_i subsampledValueHist(const Mat &img, int step) {
+        assert(img.type() == CV_8UC3);
+
+        CDE_Vec_i hist = CDE_Vec_i::all(0);
+        for (int i = 0; i < img.rows; i += step) {
+            const uchar *row = img.ptr<uchar>(i);
+            for (int j = 0; j < img.cols; j += step) {
+                const uchar *px = row + 3*j;
+                hist[std::max(px[0], std::max(px[1], px[2]))]++;
             }
         }
+        return hist;
+    }
+
+    // Level k of a curve sampled at `levels` bins covers intensities up to the
+    // upper edge of the bin, (k+1) * step - 1. Interpolates linearly between the
+    // edges, starting from 0 just below intensity 0.
+    CDE_Vec_f upsampleLevels(const CDE_Vec_f &func, int levels) {
+        int step = ((int)kMaxIntensity + 1) / levels;
+        CDE_Vec_f F;
+        for (int v = 0; v <= kMaxIntensity; v++) {
+            int b = v / step;
+            float t = (float)(v - b*step + 1) / step;
+            float prev = b > 0 ? func[b - 1] : 0.f;
+            F[v] = (1 - t) * prev + t * func[b];
+        }
+        return F;
+    }
+
+    template <typename T>
+    inline size_t vectorBytes(const vector<T> &v) {
+        return v.capacity() * sizeof(T);
+    }
+
+    inline void trackStage(CDEMemoryStats *mem, CDEStage stage) {
+        if (mem)
+            mem->enterStage(stage);
+    }
+
+    inline void trackAlloc(CDEMemoryStats *mem, size_t bytes, size_t count = 1) {
+        if (mem)
+            mem->allocate(bytes, count);
+    }
+
+    inline void trackRelease(CDEMemoryStats *mem, size_t bytes) {
+        if (mem)
+            mem->release(bytes);
+    }
+
+    // The channels stay allocated after the call, the HSV image does not.
+    inline void splitHSV(const Mat &bgr_img, vector<Mat> &hsv_channels, CDEMemoryStats *mem = nullptr) {
+        Mat hsv_img;
+        cv::cvtColor(bgr_img, hsv_img, CV_BGR2HSV_FULL);
+        trackAlloc(mem, matBytes(hsv_img));
+        cv::split(hsv_img, hsv_channels);
+        trackAlloc(mem, matBytes(hsv_img), hsv_channels.size());
+        trackRelease(mem, matBytes(hsv_img));
+    }
+
+    // bgr_img is only counted if it had to be (re)allocated.
+    inline void mergeHSV(const vector<Mat> &hsv_channels, Mat &bgr_img, CDEMemoryStats *mem = nullptr) {
+        Mat hsv_img;
+        cv::merge(hsv_channels, hsv_img);
+        trackAlloc(mem, matBytes(hsv_img));
+        const uchar *old_data = bgr_img.data;
+        cv::cvtColor(hsv_img, bgr_img, CV_HSV2BGR_FULL);
+        if (bgr_img.data != old_data)
+            trackAlloc(mem, matBytes(bgr_img));
+        trackRelease(mem, matBytes(hsv_img));
+    }
+
+    // Apply step shared by enhance() and applyTransform().
+    void applyCurve(const Mat &in_img, const CDECurve &curve, Mat &out_img, CDEMemoryStats *mem) {
+        vector<Mat> hsv_channels;
+        trackStage(mem, kStageConvert);
+        splitHSV(in_img, hsv_channels, mem);
+        trackStage(mem, kStageApply);
+        cv::LUT(hsv_channels[2], curve.toLUT(), hsv_channels[2]);
+        mergeHSV(hsv_channels, out_img, mem);
+        trackRelease(mem, 3 * matBytes(hsv_channels[2]));
     }
 
 }
@@ -160,30 +256,304 @@ namespace {
 // a contrast pair with no contrast, i.e., low_val_ = high_val_;
 const ContrastPair CDE::noneContrast = ContrastPair();
 
-void CDE::enhance(const cv::Mat &in_img, cv::Mat &out_img) {
-    uint i, j, k;
-    Mat hsv_img;
-    cvtColor(in_img, hsv_img, CV_BGR2HSV_FULL);
+// The regions are taken against the full intensity range rather than the image
+// maximum, so that a uniformly dim image is never judged well exposed.
+bool CDE::isWellExposed(const cv::Mat &in_img, CDEStats *stats) {
+    int64 start = cv::getTickCount();
+    CDE_Vec_i hist = subsampledValueHist(in_img, prescan_step_);
+
+    uint dark_bound = std::floor((float)kMaxIntensity * bounds_[0]);
+    uint bright_bound = std::floor((float)kMaxIntensity * bounds_[1]);
+
+    int total = 0, num_dark = 0, maxI = 0;
+    for (uint k = 0; k <= kMaxIntensity; k++) {
+        total += hist[k];
+        if (k <= dark_bound)
+            num_dark += hist[k];
+        if (hist[k] > 0)
+            maxI = k;
+    }
+
+    float dark_fraction = total > 0 ? (float)num_dark / total : 0.f;
+    bool well_exposed = dark_fraction <= prescan_dark_fraction_ && (uint)maxI >= bright_bound;
+
+    if (stats) {
+        stats->dark_fraction = dark_fraction;
+        stats->prescan_ms = elapsedMs(start);
+    }
+    return well_exposed;
+}
+
+void CDE::enhance(const cv::Mat &in_img, cv::Mat &out_img, CDEStats *stats) {
+    int64 start = cv::getTickCount();
+
+    CDECurve curve;
+    if (!computeTransform(in_img, curve, stats)) {
+        out_img = in_img;
+        return;
+    }
+
+#ifdef __CDE_DEBUG__
+    plot(curve.getFunc(), "transform function");
+#endif
+
+    applyCurve(in_img, curve, out_img, stats ? &stats->memory : nullptr);
+
+    if (stats)
+        stats->total_ms = elapsedMs(start);
+}
+
+bool CDE::computeTransform(const cv::Mat &in_img, CDECurve &curve, CDEStats *stats) {
+    int64 start = cv::getTickCount();
+    if (stats)
+        *stats = CDEStats();
+
+    if (prescan_ && isWellExposed(in_img, stats)) {
+        curve = CDECurve();
+        if (stats) {
+            stats->skipped = true;
+            stats->total_ms = elapsedMs(start);
+        }
+        return false;
+    }
+
+    CDEMemoryStats *mem = stats ? &stats->memory : nullptr;
     vector<Mat> hsv_channels;
-    for (int i = 0; i < 3; i++)
-        hsv_channels.push_back(Mat());
+    trackStage(mem, kStageConvert);
+    splitHSV(in_img, hsv_channels, mem);
+    CDE_Vec_f func;
+    computeTransformFunc(hsv_channels[2], func, nullptr, stats);
+    curve = CDECurve(func);
+    trackRelease(mem, 3 * matBytes(hsv_channels[2]));
+
+    if (stats)
+        stats->total_ms = elapsedMs(start);
+    return true;
+}
+
+void CDE::applyTransform(const cv::Mat &in_img, const CDECurve &curve, cv::Mat &out_img, CDEStats *stats) {
+    int64 start = cv::getTickCount();
+    if (stats)
+        *stats = CDEStats();
+
+    applyCurve(in_img, curve, out_img, stats ? &stats->memory : nullptr);
+
+    if (stats)
+        stats->total_ms = elapsedMs(start);
+}
+
+// Mirrors the accounting of computeBinnedTransformFunc(), with every pair taken
+// as an edge pair and twice the pair set sizes for vector growth.
+size_t CDE::estimateAnalysisMemory(size_t num_pixels) const {
+    size_t pairs_bytes = num_pixels * kNumNeighbors / 2 * sizeof(ContrastPair);
+    size_t pixel_sets_bytes = num_pixels * (sizeof(ContrastPairSet) + kNumNeighbors * sizeof(const ContrastPair *));
+    // every pair is reached from both of its pixels and pushed to both of its
+    // intensities, so 4 pushes per pair, doubled for vector growth
+    size_t intensity_sets_bytes = 4 * (num_pixels * kNumNeighbors / 2) * 2 * sizeof(const ContrastPair *);
+    size_t funcs_bytes = (kMaxIntensity+1) * (sizeof(ContrastPairSet) + sizeof(pair<Intensity, CDE_Vec_f>));
+
+    return 3 * num_pixels // H, S, V channels
+        + pairs_bytes + pixel_sets_bytes + intensity_sets_bytes + funcs_bytes;
+}
+
+size_t CDE::estimateMemory(int width, int height, CDEMode mode, int scale) const {
+    assert(width > 0 && height > 0 && scale > 0);
+    size_t num_pixels = (size_t)width * height;
+    // rounded up per axis, as the DCT scaling of libjpeg does
+    size_t proxy_pixels = (size_t)((width + scale - 1) / scale) * ((height + scale - 1) / scale);
+
+    switch (mode) {
+    case kModeFull:
+        // channels + merged HSV + output during the apply stage
+        return std::max(estimateAnalysisMemory(num_pixels), 9 * num_pixels);
+    case kModeProxy:
+        return 3 * proxy_pixels + std::max(estimateAnalysisMemory(proxy_pixels), 9 * num_pixels);
+    case kModeStreaming: {
+        // decoded proxy and its BGR copy, the analysis next to the BGR copy,
+        // then a 16-row strip with its HSV image and channels
+        size_t strip_bytes = 16 * (size_t)width * 3;
+        return std::max(std::max(6 * proxy_pixels, 3 * proxy_pixels + estimateAnalysisMemory(proxy_pixels)),
+                        3 * strip_bytes);
+    }
+    default:
+        return 0;
+    }
+}
 
-    split(hsv_img, hsv_channels);
+std::shared_ptr<CDEProgressiveJob> CDE::enhanceProgressive(const cv::Mat &in_img, cv::Mat &preview_img, double budget_ms,
+                                                             CDEResultCallback on_done, CDEStats *stats) {
+    int64 start = cv::getTickCount();
+    if (stats)
+        *stats = CDEStats();
+
+    std::shared_ptr<CDEProgressiveJob> job = std::make_shared<CDEProgressiveJob>();
+    if (in_img.empty()) {
+        std::promise<Mat> empty_result;
+        empty_result.set_value(Mat());
+        job->result_ = empty_result.get_future().share();
+        preview_img = Mat();
+        return job;
+    }
+    std::shared_ptr<std::atomic<bool> > cancelled = job->cancelled_;
+    bool skipped = prescan_ && isWellExposed(in_img, stats);
+
+    // The pre-scan and the downscale run over the full input; the proxy gets
+    // what is left of the budget after them. Never upscaled.
+    double input_mpixels = (double)in_img.rows * in_img.cols * 1e-6;
+    double proxy_budget_ms = budget_ms - elapsedMs(start) - preview_input_ms_per_mpixel_ * input_mpixels;
+    double proxy_area = std::max(proxy_budget_ms / preview_ms_per_mpixel_ * 1e6, (double)kMinPreviewSide * kMinPreviewSide);
+    double scale = std::min(1.0, std::sqrt(proxy_area / (input_mpixels * 1e6)));
+    cv::Size proxy_size(std::max(1, (int)std::round(in_img.cols * scale)), std::max(1, (int)std::round(in_img.rows * scale)));
+
+    CDEMemoryStats *mem = stats ? &stats->memory : nullptr;
+    int64 resize_start = cv::getTickCount();
+    Mat proxy;
+    cv::resize(in_img, proxy, proxy_size, 0, 0, cv::INTER_AREA);
+    trackAlloc(mem, matBytes(proxy));
+    float resize_measured = (float)(elapsedMs(resize_start) / input_mpixels);
+    preview_input_ms_per_mpixel_ = .5f * preview_input_ms_per_mpixel_ + .5f * resize_measured;
+
+    if (skipped) {
+        preview_img = proxy;
+    } else {
+        int64 preview_start = cv::getTickCount();
+        vector<Mat> hsv_channels;
+        trackStage(mem, kStageConvert);
+        splitHSV(proxy, hsv_channels, mem);
+        CDE_Vec_f func;
+        computeBinnedTransformFunc(hsv_channels[2], bins_, func, nullptr, mem);
+        trackStage(mem, kStageApply);
+        cv::LUT(hsv_channels[2], CDECurve(func).toLUT(), hsv_channels[2]);
+        mergeHSV(hsv_channels, preview_img, mem);
+        trackRelease(mem, 3 * matBytes(hsv_channels[2]) + matBytes(proxy));
+
+        float measured = (float)(elapsedMs(preview_start) / (proxy_size.area() * 1e-6));
+        preview_ms_per_mpixel_ = .5f * preview_ms_per_mpixel_ + .5f * measured;
+    }
+
+    if (stats) {
+        stats->skipped = skipped;
+        stats->bins = bins_;
+        stats->total_ms = elapsedMs(start);
+    }
+
+    // The worker copies the settings and holds only the cancel flag and the
+    // promise, not the job, so dropping the job cancels the pass instead of
+    // joining it. No debug plotting here, as it would open windows from the
+    // worker thread.
+    CDE cde = *this;
+    Mat full_img = in_img;
+    std::shared_ptr<std::promise<Mat> > result = std::make_shared<std::promise<Mat> >();
+    std::shared_ptr<CDEStats> full_stats = job->stats_;
+    job->result_ = result->get_future().share();
+    std::thread([cde, full_img, skipped, cancelled, on_done, result, full_stats]() mutable {
+        // An exception escaping a detached thread would terminate the process;
+        // the likely one here is std::bad_alloc on a large input.
+        try {
+            int64 full_start = cv::getTickCount();
+            CDEMemoryStats *full_mem = &full_stats->memory;
+            full_stats->skipped = skipped;
+            full_stats->bins = cde.bins_;
+
+            Mat out_img;
+            if (!skipped) {
+                vector<Mat> hsv_channels;
+                trackStage(full_mem, kStageConvert);
+                splitHSV(full_img, hsv_channels, full_mem);
+                CDE_Vec_f func;
+                if (*cancelled || !cde.computeBinnedTransformFunc(hsv_channels[2], cde.bins_, func, cancelled.get(), full_mem)) {
+                    result->set_value(Mat());
+                    return;
+                }
+                trackStage(full_mem, kStageApply);
+                cv::LUT(hsv_channels[2], CDECurve(func).toLUT(), hsv_channels[2]);
+                mergeHSV(hsv_channels, out_img, full_mem);
+                trackRelease(full_mem, 3 * matBytes(hsv_channels[2]));
+            } else {
+                out_img = full_img;
+            }
+            full_stats->total_ms = elapsedMs(full_start);
+
+            if (*cancelled) {
+                result->set_value(Mat());
+                return;
+            }
+            if (on_done)
+                on_done(out_img);
+            result->set_value(out_img);
+        } catch (...) {
+            result->set_exception(std::current_exception());
+        }
+    }).detach();
+
+    return job;
+}
+
+// Returns false, leaving func untouched, if cancelled.
+bool CDE::computeTransformFunc(const cv::Mat &v_channel, CDE_Vec_f &func, const std::atomic<bool> *cancel,
+                               CDEStats *stats) {
+    CDEMemoryStats *mem = stats ? &stats->memory : nullptr;
+    CDE_Vec_f binned;
+    if (!computeBinnedTransformFunc(v_channel, bins_, binned, cancel, mem))
+        return false;
+
+    if (stats) {
+        stats->bins = bins_;
+        if (measure_bins_error_ && bins_ <= kMaxIntensity) {
+            CDE_Vec_f exact;
+            if (!computeBinnedTransformFunc(v_channel, kMaxIntensity+1, exact, cancel, mem))
+                return false;
+
+            CDE_Vec_i hist = CDE_Vec_i::all(0);
+            for (int i = 0; i < v_channel.rows; i++) {
+                const uchar *row = v_channel.ptr<uchar>(i);
+                for (int j = 0; j < v_channel.cols; j++)
+                    hist[row[j]]++;
+            }
+
+            double curve_error = 0, output_error = 0;
+            for (int k = 0; k <= kMaxIntensity; k++) {
+                curve_error = std::max(curve_error, (double)std::abs(binned[k] - exact[k]) * kMaxIntensity);
+                output_error += hist[k] * std::abs(std::round(binned[k] * kMaxIntensity) - std::round(exact[k] * kMaxIntensity));
+            }
+            stats->curve_error = (float)curve_error;
+            stats->output_error = (float)(output_error / ((double)v_channel.rows * v_channel.cols));
+        }
+    }
+
+    func = binned;
+    return true;
+}
+
+// Works on V quantised to `bins` levels; the region split and weights are taken
+// at the upper edge of each bin and the result is interpolated back to 256 entries.
+bool CDE::computeBinnedTransformFunc(const cv::Mat &v_channel, int bins, CDE_Vec_f &func, const std::atomic<bool> *cancel,
+                                     CDEMemoryStats *mem) {
+    uint i, j, k;
+    int step = ((int)kMaxIntensity + 1) / bins;
+
+    trackStage(mem, kStagePairs);
 
     vector<ContrastPair> pairs;
     vector<ContrastPairSet> pairs_of_pixels; // neighbor pairs of each pixel
-    generateContrastPairs(hsv_channels[2], pairs, pairs_of_pixels);
+    if (!generateContrastPairs(v_channel, step, pairs, pairs_of_pixels, cancel))
+        return false;
+    size_t pairs_bytes = vectorBytes(pairs) + vectorBytes(pairs_of_pixels)
+                       + pairs_of_pixels.size() * kNumNeighbors * sizeof(const ContrastPair *);
+    trackAlloc(mem, pairs_bytes, 2 + pairs_of_pixels.size());
 
-    vector<ContrastPairSet> pairs_of_intensities(kMaxIntensity+1, ContrastPairSet());
+    vector<ContrastPairSet> pairs_of_intensities(bins, ContrastPairSet());
 
     uint idx = 0;
     const ContrastPair *p;
-    for (i = 0; i < (uint)in_img.rows; i++) {
-        for (j = 0; j < (uint)in_img.cols; j++) {
-            idx = i*in_img.cols + j;
+    for (i = 0; i < (uint)v_channel.rows; i++) {
+        if (isCancelled(cancel, i))
+            return false;
+        for (j = 0; j < (uint)v_channel.cols; j++) {
+            idx = i*v_channel.cols + j;
             for (int n = 0; n < kNumNeighbors; n++) {
                 p = pairs_of_pixels.at(idx).at(n);
-                if (isEdgeContrastPair(p)) {
+                if (isEdgeContrastPair(p, step)) {
                     pairs_of_intensities.at(p->getLow()).push_back(p);
                     pairs_of_intensities.at(p->getHigh()).push_back(p);
                 }
@@ -191,18 +561,32 @@ void CDE::enhance(const cv::Mat &in_img, cv::Mat &out_img) {
         }
     }
 
+    size_t sets_bytes = vectorBytes(pairs_of_intensities);
+    size_t num_sets = 1;
+    for (k = 0; k < (uint)bins; k++) {
+        sets_bytes += vectorBytes(pairs_of_intensities[k]);
+        num_sets += pairs_of_intensities[k].capacity() > 0;
+    }
+    trackStage(mem, kStageStatistics);
+    trackAlloc(mem, sets_bytes, num_sets);
+
     vector<pair<Intensity, CDE_Vec_f> > transform_funcs;
-    for (k = 0; k <= kMaxIntensity; k++) {
+    for (k = 0; k < (uint)bins; k++) {
+        if (cancel && *cancel)
+            return false;
         if (pairs_of_intensities.at(k).size() > 0) {
             transform_funcs.push_back(
-                std::make_pair(k, generateTransformFunc(pairs_of_intensities.at(k)))
+                std::make_pair(k, generateTransformFunc(pairs_of_intensities.at(k), bins))
             );
         }
     }
 
+    trackAlloc(mem, vectorBytes(transform_funcs));
+
     // calculate region transform functions for the dark, middle, and bright regions
     double maxI;
-    cv::minMaxIdx(hsv_channels[2], nullptr, &maxI);
+    cv::minMaxIdx(v_channel, nullptr, &maxI);
+    maxI = std::floor(maxI / step);
     uint bound_1 = std::floor((float)maxI * bounds_[0]);
     uint bound_2 = std::floor((float)maxI * bounds_[1]);
 
@@ -229,14 +613,15 @@ void CDE::enhance(const cv::Mat &in_img, cv::Mat &out_img) {
     region_transform_funcs[2] /= num_r2;
 
     vector<CDE_Vec_f> region_weights_funcs(3, CDE_Vec_f::all(0.f));
-    for (k = 0; k <= kMaxIntensity; k++) {
-        region_weights_funcs[0][k] = Gaussian1D(0, sigmas_[0], (double)k/kMaxIntensity);
-        region_weights_funcs[1][k] = Gaussian1D(0.5, sigmas_[1], (double)k/kMaxIntensity);
-        region_weights_funcs[2][k] = Gaussian1D(1.0, sigmas_[2], (double)k/kMaxIntensity);
+    for (k = 0; k < (uint)bins; k++) {
+        double x = (double)((k+1)*step - 1) / kMaxIntensity;
+        region_weights_funcs[0][k] = Gaussian1D(0, sigmas_[0], x);
+        region_weights_funcs[1][k] = Gaussian1D(0.5, sigmas_[1], x);
+        region_weights_funcs[2][k] = Gaussian1D(1.0, sigmas_[2], x);
     }
 
     CDE_Vec_f final_transform_func = CDE_Vec_f::all(0);
-    for (k = 0; k <= kMaxIntensity; k++) {
+    for (k = 0; k < (uint)bins; k++) {
         final_transform_func[k] = region_weights_funcs[0][k] * region_transform_funcs[0][k]
                                 + region_weights_funcs[1][k] * region_transform_funcs[1][k]
                                 + region_weights_funcs[2][k] * region_transform_funcs[2][k]
@@ -245,6 +630,8 @@ void CDE::enhance(const cv::Mat &in_img, cv::Mat &out_img) {
                                 + region_weights_funcs[1][k] * region_weights_funcs[2][k] * region_transform_funcs[2][k] / 3;
         final_transform_func[k] /= (region_weights_funcs[0][k] + region_weights_funcs[1][k] + region_weights_funcs[2][k] + 1e-10);
     }
+    if (step > 1)
+        final_transform_func = upsampleLevels(final_transform_func, bins);
 
     final_transform_func = weight_ * final_transform_func  + (1-weight_) * identity();
     for (k = 0; k < final_transform_func.rows; k++) {
@@ -253,14 +640,7 @@ void CDE::enhance(const cv::Mat &in_img, cv::Mat &out_img) {
         }
     }
 
-#ifdef __CDE_DEBUG__
-    plot(final_transform_func, "transform function");
-#endif
-
-    Mat enhanced_v;
-    applyTransform(hsv_channels[2], enhanced_v, final_transform_func);
-    hsv_channels[2] = enhanced_v;
-
-    cv::merge(hsv_channels, hsv_img);
-    cv::cvtColor(hsv_img, out_img, CV_HSV2BGR_FULL);
+    trackRelease(mem, vectorBytes(transform_funcs) + sets_bytes + pairs_bytes);
+    func = final_transform_func;
+    return true;
 }
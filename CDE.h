@@ -9,9 +9,14 @@
 #define __CDE__
 
 #include <iostream>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
 #include <opencv2/core/core.hpp>
 
-#define __CDE_DEBUG__
+// Build CDE.cpp with -D__CDE_DEBUG__ to plot the transform function in CDE::enhance().
 
 typedef unsigned char Intensity;
 const Intensity kMaxIntensity = (Intensity)255;
@@ -19,6 +24,8 @@ const Intensity kMaxIntensity = (Intensity)255;
 typedef cv::Vec<int, (int)kMaxIntensity+1> CDE_Vec_i;
 typedef cv::Vec<float, (int)kMaxIntensity+1> CDE_Vec_f;
 
+class CDECurve;
+
 class ContrastPair {
 public:
     ContrastPair() : low_val_(0), high_val_(0) {};
@@ -49,6 +56,145 @@ private:
     Intensity low_val_, high_val_;
 };
 
+// Pipeline stages, for the per-stage memory high-water marks.
+enum CDEStage {
+    kStageConvert = 0,      // BGR to HSV conversion and channel split
+    kStagePairs,            // contrast pairs and the pair sets of each pixel
+    kStageStatistics,       // pair sets of each intensity and transform functions
+    kStageApply,            // curve application and conversion back to BGR
+    kNumStages
+};
+
+// Ways of running the pipeline, for CDE::estimateMemory().
+enum CDEMode {
+    kModeFull = 0,          // enhance(), and the full-resolution pass of enhanceProgressive()
+    kModeProxy,             // computeTransform() on a 1/scale proxy, then applyTransform()
+    kModeStreaming          // enhanceJpegFile() with a 1/scale statistics decode
+};
+
+// Memory accounting of one call. Sizes are derived from the dimensions and
+// capacities of the buffers the pipeline allocates, not from allocator hooks,
+// and exclude the caller's input image.
+class CDEMemoryStats {
+public:
+    CDEMemoryStats() : current_(0), peak_(0), count_(0), stage_(kStageConvert) {
+        for (int s = 0; s < kNumStages; s++)
+            stage_peak_[s] = 0;
+    };
+
+    inline void enterStage(CDEStage stage) {
+        stage_ = stage;
+        stage_peak_[stage] = std::max(stage_peak_[stage], current_);
+    };
+
+    inline void allocate(size_t bytes, size_t count = 1) {
+        current_ += bytes;
+        count_ += count;
+        peak_ = std::max(peak_, current_);
+        stage_peak_[stage_] = std::max(stage_peak_[stage_], current_);
+    };
+
+    inline void release(size_t bytes) {
+        current_ -= std::min(bytes, current_);
+    };
+
+    // Folds in the accounting of a nested call made while this one holds its
+    // current bytes. Bytes the nested call still held at its end stay held.
+    inline void nest(const CDEMemoryStats &inner) {
+        for (int s = 0; s < kNumStages; s++)
+            if (inner.stage_peak_[s] > 0)
+                stage_peak_[s] = std::max(stage_peak_[s], current_ + inner.stage_peak_[s]);
+        peak_ = std::max(peak_, current_ + inner.peak_);
+        count_ += inner.count_;
+        current_ += inner.current_;
+    };
+
+    inline size_t getPeakBytes() const {
+        return peak_;
+    };
+
+    inline size_t getAllocCount() const {
+        return count_;
+    };
+
+    inline size_t getStagePeakBytes(CDEStage stage) const {
+        return stage_peak_[stage];
+    };
+
+private:
+    size_t current_, peak_, count_;
+    size_t stage_peak_[kNumStages];
+    CDEStage stage_;
+};
+
+// Report of a single call, filled in when a stats pointer is given: CDE::enhance(),
+// computeTransform(), applyTransform(), enhanceProgressive() (the preview; the
+// full pass reports through CDEProgressiveJob::getStats()) and enhanceJpegFile().
+// skipped means out_img shares in_img's data for enhance(), the curve is the
+// identity for computeTransform(), and the input was copied for enhanceJpegFile().
+struct CDEStats {
+    CDEStats() :
+        skipped(false), dark_fraction(0.f), prescan_ms(0.0), total_ms(0.0),
+        bins(0), curve_error(0.f), output_error(0.f)
+    {};
+
+    bool skipped;           // pre-scan found the image well exposed
+    float dark_fraction;    // fraction of pre-scan samples falling in the dark region
+    double prescan_ms;      // time spent in the pre-scan
+    double total_ms;        // time spent in the whole call
+    int bins;               // intensity bins the pair statistics were gathered at
+    float curve_error;      // max curve deviation from the 256-bin path, in intensity levels
+    float output_error;     // mean output V deviation from the 256-bin path, in intensity levels
+    CDEMemoryStats memory;
+};
+
+typedef std::function<void(const cv::Mat &)> CDEResultCallback;
+
+// Handle on the full-resolution pass started by CDE::enhanceProgressive().
+// The pass owns its copy of the settings, so the CDE may be reused meanwhile.
+// It runs on a detached thread: dropping the last handle cancels it and
+// returns at once, and the thread exits at its next cancellation check
+// without calling the result callback.
+class CDEProgressiveJob {
+public:
+    CDEProgressiveJob() :
+        cancelled_(std::make_shared<std::atomic<bool> >(false)),
+        stats_(std::make_shared<CDEStats>())
+    {};
+
+    ~CDEProgressiveJob() {
+        cancel();
+    };
+
+    // Stops the pass within a few rows of its current position. The callback
+    // is then not called and the result is an empty Mat.
+    inline void cancel() {
+        *cancelled_ = true;
+    };
+
+    inline bool isCancelled() const {
+        return *cancelled_;
+    };
+
+    // Enhanced full-resolution image, or an empty Mat if cancelled or the input
+    // was empty. get() rethrows an exception of the pass, e.g. std::bad_alloc.
+    inline std::shared_future<cv::Mat> getResult() const {
+        return result_;
+    };
+
+    // Timing and memory of the full-resolution pass, valid once the result is ready.
+    inline const CDEStats &getStats() const {
+        return *stats_;
+    };
+
+private:
+    friend class CDE;
+
+    std::shared_ptr<std::atomic<bool> > cancelled_;
+    std::shared_ptr<CDEStats> stats_;
+    std::shared_future<cv::Mat> result_;
+};
+
 // Contrast Division based Enhancement
 // Parameters
 //  - thresh:   threshold for the contrast pairs. (Default 10)
@@ -64,26 +210,105 @@ public:
         thresh_(10),
         weight_(.8f),
         sigmas_(cv::Vec3f(3.f, 1.f, .5f)),
-        bounds_(cv::Vec2f(1.f/3, 2.f/3))
+        bounds_(cv::Vec2f(1.f/3, 2.f/3)),
+        prescan_(false),
+        prescan_step_(4),
+        prescan_dark_fraction_(.05f),
+        preview_ms_per_mpixel_(2000.f),
+        preview_input_ms_per_mpixel_(10.f),
+        bins_(kMaxIntensity+1),
+        measure_bins_error_(false)
     {};
 
     CDE(int thresh, int val, int step, float weight_t, cv::Vec3f sigmas, cv::Vec2f bounds) :
         thresh_(thresh),
         weight_(weight_t),
         sigmas_(sigmas),
-        bounds_(bounds)
+        bounds_(bounds),
+        prescan_(false),
+        prescan_step_(4),
+        prescan_dark_fraction_(.05f),
+        preview_ms_per_mpixel_(2000.f),
+        preview_input_ms_per_mpixel_(10.f),
+        bins_(kMaxIntensity+1),
+        measure_bins_error_(false)
     {};
 
-    void enhance(const cv::Mat &in_img, cv::Mat &out_img);
+    // Enables a cheap pre-scan of a subsampled V histogram before enhancing.
+    // Images whose dark region (below bounds_[0]) holds at most max_dark_fraction
+    // of the samples, and which reach the bright region, are returned unchanged.
+    //  - step:  sample every step-th row and column. (Default 4)
+    inline void setPrescan(bool enabled, float max_dark_fraction = .05f, int step = 4) {
+        assert(step > 0);
+        prescan_ = enabled;
+        prescan_dark_fraction_ = max_dark_fraction;
+        prescan_step_ = step;
+    };
+
+    // Gathers the pair statistics at a reduced number of intensity bins (64 or
+    // 128) and interpolates the curve back to 256 entries, trading a little
+    // accuracy for less work. bins must divide 256. With measure_error, each
+    // call also runs the 256-bin path and reports the difference in CDEStats.
+    inline void setBins(int bins, bool measure_error = false) {
+        assert(bins >= 2 && bins <= kMaxIntensity+1 && (kMaxIntensity+1) % bins == 0);
+        bins_ = bins;
+        measure_bins_error_ = measure_error;
+    };
+
+    // Enhances a BGR image. If the pre-scan skips the image, out_img is a shallow
+    // copy of in_img and stats->skipped is set, so the caller may skip re-encoding.
+    void enhance(const cv::Mat &in_img, cv::Mat &out_img, CDEStats *stats = nullptr);
+
+    // Analysis half of enhance(): computes the transform curve of a BGR image,
+    // which may be a downscaled proxy of the image it is later applied to.
+    // Returns false, with an identity curve, if the pre-scan skips the image.
+    bool computeTransform(const cv::Mat &in_img, CDECurve &curve, CDEStats *stats = nullptr);
+
+    // Apply half of enhance(): maps the V channel of a BGR image through the curve.
+    static void applyTransform(const cv::Mat &in_img, const CDECurve &curve, cv::Mat &out_img,
+                               CDEStats *stats = nullptr);
+
+    // Upper bound on the peak bytes CDEStats::memory would report for a width x
+    // height input with the current settings, for admitting jobs up front.
+    // scale is the proxy or decode reduction of kModeProxy and kModeStreaming.
+    size_t estimateMemory(int width, int height, CDEMode mode, int scale = 4) const;
+
+    // Progressive mode for interactive use. Returns with preview_img, enhanced
+    // from a downscaled proxy sized to fit roughly in budget_ms, and starts the
+    // exact full-resolution pass in the background. on_done is called from the
+    // worker thread with its result. in_img must stay unmodified until then.
+    // The returned job must be kept alive for that: dropping it cancels the
+    // pass, and on_done is then never called.
+    // The pre-scan and downscale of the full input count against the budget;
+    // the proxy gets the rest, sized from the times measured on earlier calls.
+    // stats describe the preview; the full pass reports through job->getStats().
+    std::shared_ptr<CDEProgressiveJob> enhanceProgressive(const cv::Mat &in_img, cv::Mat &preview_img, double budget_ms,
+                                                          CDEResultCallback on_done = CDEResultCallback(),
+                                                          CDEStats *stats = nullptr);
 
 private:
     int thresh_;
     float weight_;
     cv::Vec3f sigmas_;
     cv::Vec2f bounds_;
+    bool prescan_;
+    int prescan_step_;
+    float prescan_dark_fraction_;
+    float preview_ms_per_mpixel_;       // measured cost of the preview per proxy pixel
+    float preview_input_ms_per_mpixel_; // measured cost of the downscale per input pixel
+    int bins_;
+    bool measure_bins_error_;
+
+    bool isWellExposed(const cv::Mat &in_img, CDEStats *stats);
+    bool computeTransformFunc(const cv::Mat &v_channel, CDE_Vec_f &func, const std::atomic<bool> *cancel = nullptr,
+                              CDEStats *stats = nullptr);
+    bool computeBinnedTransformFunc(const cv::Mat &v_channel, int bins, CDE_Vec_f &func, const std::atomic<bool> *cancel,
+                                    CDEMemoryStats *mem);
+    size_t estimateAnalysisMemory(size_t num_pixels) const;
 
-    inline bool isEdgeContrastPair(const ContrastPair *p) {
-        return static_cast<int>(p->getHigh() - p->getLow()) >= thresh_;
+    // step: intensities per level of the pair values, thresh_ is in intensities
+    inline bool isEdgeContrastPair(const ContrastPair *p, int step = 1) {
+        return static_cast<int>(p->getHigh() - p->getLow()) * step >= thresh_;
     };
 };
 
@@ -0,0 +1,167 @@
+//
+//  CDECurve.cpp
+//  Channel Division based Enhancement
+//
+//  Serialisable transform curve, so that analysis and application can run apart.
+//
+
+#include "CDECurve.h"
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+// helper functions
+namespace {
+
+    const char kMagic[4] = {'C', 'D', 'E', 'C'};
+    const int kNumEntries = (int)kMaxIntensity + 1;
+
+    inline void writeU32(std::ostream &os, uint32_t v) {
+        unsigned char b[4] = {
+            (unsigned char)(v), (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24)
+        };
+        os.write(reinterpret_cast<const char *>(b), 4);
+    }
+
+    inline bool readU32(std::istream &is, uint32_t &v) {
+        unsigned char b[4];
+        if (!is.read(reinterpret_cast<char *>(b), 4))
+            return false;
+        v = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+        return true;
+    }
+
+}
+
+
+/* --- Implementation of CDECurve class --- */
+
+CDECurve::CDECurve() {
+    for (int k = 0; k < kNumEntries; k++)
+        func_[k] = (float)k / kMaxIntensity;
+}
+
+cv::Mat CDECurve::toLUT() const {
+    cv::Mat lut(1, kNumEntries, CV_8UC1);
+    for (int k = 0; k < kNumEntries; k++)
+        lut.at<uchar>(0, k) = std::isfinite(func_[k])
+                            ? (uchar)std::round(std::min(std::max(func_[k], 0.f), 1.f) * kMaxIntensity)
+                            : 0;
+    return lut;
+}
+
+bool CDECurve::save(const std::string &path) const {
+    std::ofstream os(path.c_str(), std::ios::binary);
+    if (!os)
+        return false;
+
+    os.write(kMagic, 4);
+    writeU32(os, kVersion);
+    writeU32(os, kNumEntries);
+    for (int k = 0; k < kNumEntries; k++) {
+        uint32_t bits;
+        std::memcpy(&bits, &func_[k], 4);
+        writeU32(os, bits);
+    }
+    return (bool)os;
+}
+
+bool CDECurve::load(const std::string &path) {
+    std::ifstream is(path.c_str(), std::ios::binary);
+    char magic[4];
+    uint32_t version, entries;
+    if (!is.read(magic, 4) || std::memcmp(magic, kMagic, 4) != 0)
+        return false;
+    if (!readU32(is, version) || version == 0 || version > kVersion)
+        return false;
+    if (!readU32(is, entries) || entries != (uint32_t)kNumEntries)
+        return false;
+
+    CDE_Vec_f func;
+    for (int k = 0; k < kNumEntries; k++) {
+        uint32_t bits;
+        if (!readU32(is, bits))
+            return false;
+        std::memcpy(&func[k], &bits, 4);
+        if (!std::isfinite(func[k]))
+            return false;
+    }
+    func_ = func;
+    return true;
+}
+
+bool CDECurve::saveCube(const std::string &path, const std::string &title) const {
+    std::ofstream os(path.c_str());
+    if (!os)
+        return false;
+
+    os << "# CDE curve version " << kVersion << "\n";
+    os << "TITLE \"" << title << "\"\n";
+    os << "LUT_1D_SIZE " << kNumEntries << "\n";
+    os << "DOMAIN_MIN 0.0 0.0 0.0\n";
+    os << "DOMAIN_MAX 1.0 1.0 1.0\n";
+    os.setf(std::ios::fixed);
+    os.precision(6);
+    for (int k = 0; k < kNumEntries; k++)
+        os << func_[k] << " " << func_[k] << " " << func_[k] << "\n";
+    return (bool)os;
+}
+
+// Channels are averaged, as the curve is applied to V only. The input domain,
+// from DOMAIN_MIN/DOMAIN_MAX or LUT_1D_INPUT_RANGE, must be the same on all
+// channels; intensities outside it take the end values of the table.
+bool CDECurve::loadCube(const std::string &path) {
+    std::ifstream is(path.c_str());
+    if (!is)
+        return false;
+
+    int size = 0;
+    float domain_min = 0.f, domain_max = 1.f;
+    std::vector<float> table;
+    std::string line;
+    while (std::getline(is, line)) {
+        std::istringstream ls(line);
+        std::string key;
+        if (!(ls >> key) || key[0] == '#')
+            continue;
+
+        if (key == "LUT_1D_SIZE") {
+            if (!(ls >> size))
+                return false;
+        } else if (key == "LUT_3D_SIZE") {
+            return false;
+        } else if (key == "DOMAIN_MIN" || key == "DOMAIN_MAX") {
+            float r, g, b;
+            if (!(ls >> r >> g >> b) || r != g || g != b)
+                return false;
+            (key == "DOMAIN_MIN" ? domain_min : domain_max) = r;
+        } else if (key == "LUT_1D_INPUT_RANGE") {
+            if (!(ls >> domain_min >> domain_max))
+                return false;
+        } else if (std::isalpha((unsigned char)key[0])) {
+            continue;   // TITLE and other keywords that do not change the curve
+        } else {
+            std::istringstream vs(line);
+            float r, g, b;
+            if (!(vs >> r >> g >> b) || !std::isfinite(r) || !std::isfinite(g) || !std::isfinite(b))
+                return false;
+            table.push_back((r + g + b) / 3);
+        }
+    }
+    if (size < 2 || (int)table.size() != size)
+        return false;
+    if (!std::isfinite(domain_min) || !std::isfinite(domain_max) || domain_max <= domain_min)
+        return false;
+
+    for (int k = 0; k < kNumEntries; k++) {
+        float x = ((float)k / kMaxIntensity - domain_min) / (domain_max - domain_min);
+        x = std::min(std::max(x, 0.f), 1.f) * (size - 1);
+        int x0 = std::min((int)x, size - 2);
+        float t = x - x0;
+        func_[k] = (1 - t) * table[x0] + t * table[x0 + 1];
+    }
+    return true;
+}
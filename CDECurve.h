@@ -0,0 +1,57 @@
+//
+//  CDECurve.h
+//  Channel Division based Enhancement
+//
+//  Serialisable transform curve, so that analysis and application can run apart.
+//
+
+#ifndef __CDE_CURVE__
+#define __CDE_CURVE__
+
+#include <string>
+#include <stdint.h>
+#include "CDE.h"
+
+// The 256-entry transform curve computed by CDE::computeTransform(). Entry k is
+// the enhanced value, in [0, 1], of the input intensity k.
+//
+// File formats
+//  - binary: "CDEC", uint32 version, uint32 entry count, then the entries as
+//            float32. All fields are little-endian.
+//  - .cube:  a 1D LUT with the same value on all three channels. Loading accepts
+//            any LUT_1D_SIZE and input domain and resamples it to 256 entries.
+// Loading rejects non-finite entries.
+
+class CDECurve {
+public:
+    static const uint32_t kVersion = 1;
+
+    // identity curve
+    CDECurve();
+
+    explicit CDECurve(const CDE_Vec_f &func) : func_(func) {};
+
+    ~CDECurve() {};
+
+    inline const CDE_Vec_f &getFunc() const {
+        return func_;
+    };
+
+    inline float operator[](int k) const {
+        return func_[k];
+    };
+
+    // 1 x 256 CV_8UC1 table for cv::LUT
+    cv::Mat toLUT() const;
+
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+
+    bool saveCube(const std::string &path, const std::string &title = "CDE") const;
+    bool loadCube(const std::string &path);
+
+private:
+    CDE_Vec_f func_;
+};
+
+#endif /* defined(__CDE_CURVE__) */
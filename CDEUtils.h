@@ -0,0 +1,23 @@
+//
+//  CDEUtils.h
+//  Channel Division based Enhancement
+//
+//  Small helpers shared by CDE.cpp and JpegIO.cpp. Internal, not part of the API.
+//
+
+#ifndef __CDE_UTILS__
+#define __CDE_UTILS__
+
+#include <opencv2/core/core.hpp>
+
+// Milliseconds since a cv::getTickCount() reading.
+inline double elapsedMs(int64 start) {
+    return (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+}
+
+// Bytes held by the pixels of a Mat, as counted by CDEMemoryStats.
+inline size_t matBytes(const cv::Mat &m) {
+    return m.total() * m.elemSize();
+}
+
+#endif /* defined(__CDE_UTILS__) */
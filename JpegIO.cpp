@@ -0,0 +1,293 @@
+//
+//  JpegIO.cpp
+//  Channel Division based Enhancement
+//
+//  Two-phase JPEG front end: statistics from a reduced-scale decode, then a
+//  single full-resolution decode streamed through the curve into the encoder.
+//
+
+#include "JpegIO.h"
+#include "CDECurve.h"
+#include "CDEUtils.h"
+#include <cstdio>
+#include <cstring>
+#include <csetjmp>
+#include <fstream>
+#include <opencv2/imgproc/imgproc.hpp>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+using cv::Mat;
+
+// helper functions
+namespace {
+
+    const int kStripRows = 16;
+
+    // libjpeg calls exit() on errors by default; jump back to the caller instead
+    struct ErrorManager {
+        jpeg_error_mgr pub;
+        jmp_buf jump;
+    };
+
+    void onError(j_common_ptr cinfo) {
+        ErrorManager *err = reinterpret_cast<ErrorManager *>(cinfo->err);
+        longjmp(err->jump, 1);
+    }
+
+    // The wrappers below are the only code that calls libjpeg. Each arms the
+    // error jump itself and holds no object with a destructor, so an error never
+    // longjmps over C++ state. The structs are zeroed first, which keeps
+    // jpeg_destroy_*() safe after a failure at any point.
+
+    bool openDecompress(jpeg_decompress_struct *dinfo, ErrorManager *err, FILE *file, int scale_denom, bool *gray) {
+        std::memset(dinfo, 0, sizeof(*dinfo));
+        dinfo->err = jpeg_std_error(&err->pub);
+        err->pub.error_exit = onError;
+        if (setjmp(err->jump))
+            return false;
+
+        jpeg_create_decompress(dinfo);
+        jpeg_stdio_src(dinfo, file);
+        jpeg_read_header(dinfo, TRUE);
+
+        *gray = dinfo->jpeg_color_space == JCS_GRAYSCALE;
+        dinfo->out_color_space = *gray ? JCS_GRAYSCALE : JCS_RGB;
+        dinfo->scale_num = 1;
+        dinfo->scale_denom = scale_denom;
+        jpeg_start_decompress(dinfo);
+        return true;
+    }
+
+    bool readRows(jpeg_decompress_struct *dinfo, ErrorManager *err, JSAMPROW *rows, int n) {
+        if (setjmp(err->jump))
+            return false;
+
+        int read = 0;
+        while (read < n) {
+            int got = jpeg_read_scanlines(dinfo, rows + read, n - read);
+            if (got == 0)
+                return false;
+            read += got;
+        }
+        return true;
+    }
+
+    bool finishDecompress(jpeg_decompress_struct *dinfo, ErrorManager *err) {
+        if (setjmp(err->jump))
+            return false;
+        jpeg_finish_decompress(dinfo);
+        return true;
+    }
+
+    bool openCompress(jpeg_compress_struct *cinfo, ErrorManager *err, FILE *file,
+                      int width, int height, bool gray, int quality) {
+        std::memset(cinfo, 0, sizeof(*cinfo));
+        cinfo->err = jpeg_std_error(&err->pub);
+        err->pub.error_exit = onError;
+        if (setjmp(err->jump))
+            return false;
+
+        jpeg_create_compress(cinfo);
+        jpeg_stdio_dest(cinfo, file);
+        cinfo->image_width = width;
+        cinfo->image_height = height;
+        cinfo->input_components = gray ? 1 : 3;
+        cinfo->in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_set_defaults(cinfo);
+        jpeg_set_quality(cinfo, quality, TRUE);
+        jpeg_start_compress(cinfo, TRUE);
+        return true;
+    }
+
+    bool writeRows(jpeg_compress_struct *cinfo, ErrorManager *err, JSAMPROW *rows, int n) {
+        if (setjmp(err->jump))
+            return false;
+        jpeg_write_scanlines(cinfo, rows, n);
+        return true;
+    }
+
+    bool finishCompress(jpeg_compress_struct *cinfo, ErrorManager *err) {
+        if (setjmp(err->jump))
+            return false;
+        jpeg_finish_compress(cinfo);
+        return true;
+    }
+
+    // Output is written next to the destination and renamed over it only once
+    // complete, so in-place use (in == out) never truncates or removes the input.
+    inline std::string tempPath(const std::string &path) {
+        return path + ".cde-tmp";
+    }
+
+    inline bool commitTemp(const std::string &tmp, const std::string &dst) {
+        if (std::rename(tmp.c_str(), dst.c_str()) == 0)
+            return true;
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    inline bool copyFile(const std::string &src, const std::string &dst) {
+        std::string tmp = tempPath(dst);
+        bool ok;
+        {
+            std::ifstream is(src.c_str(), std::ios::binary);
+            std::ofstream os(tmp.c_str(), std::ios::binary);
+            ok = is && os && (os << is.rdbuf());
+        }
+        if (!ok) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return commitTemp(tmp, dst);
+    }
+
+    // Maps a strip of decoded scanlines through the curve, in place. Colour
+    // strips are RGB; the V channel is max(R, G, B) either way and the HSV
+    // round trip restores the channel order, so they need no reordering.
+    inline void transformStrip(Mat &strip, const CDECurve &curve, const Mat &lut, CDEMemoryStats &mem) {
+        if (strip.channels() == 1) {
+            cv::LUT(strip, lut, strip);
+        } else {
+            CDEStats strip_stats;
+            CDE::applyTransform(strip, curve, strip, &strip_stats);
+            mem.nest(strip_stats.memory);
+        }
+    }
+
+}
+
+
+bool readJpegScaled(const std::string &path, int scale_denom, cv::Mat &bgr_img, CDEMemoryStats *mem) {
+    assert(scale_denom == 1 || scale_denom == 2 || scale_denom == 4 || scale_denom == 8);
+
+    FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    jpeg_decompress_struct dinfo;
+    ErrorManager err;
+    bool gray = false;
+    Mat img;
+    bool ok = openDecompress(&dinfo, &err, file, scale_denom, &gray);
+    if (ok) {
+        img.create(dinfo.output_height, dinfo.output_width, gray ? CV_8UC1 : CV_8UC3);
+        if (mem)
+            mem->allocate(matBytes(img));
+        JSAMPROW rows[kStripRows];
+        for (int i = 0; ok && i < img.rows; i += kStripRows) {
+            int n = std::min(kStripRows, img.rows - i);
+            for (int r = 0; r < n; r++)
+                rows[r] = img.ptr<uchar>(i + r);
+            ok = readRows(&dinfo, &err, rows, n);
+        }
+        ok = ok && finishDecompress(&dinfo, &err);
+    }
+    jpeg_destroy_decompress(&dinfo);
+    std::fclose(file);
+    if (!ok) {
+        if (mem)
+            mem->release(matBytes(img));
+        return false;
+    }
+
+    cv::cvtColor(img, bgr_img, gray ? CV_GRAY2BGR : CV_RGB2BGR);
+    if (mem) {
+        mem->allocate(matBytes(bgr_img));
+        mem->release(matBytes(img));
+    }
+    return true;
+}
+
+bool enhanceJpegFile(CDE &cde, const std::string &in_path, const std::string &out_path,
+                     int scale_denom, int quality, CDEStats *stats) {
+    int64 start = cv::getTickCount();
+
+    // phase 1: statistics on the reduced decode
+    CDEMemoryStats mem;
+    mem.enterStage(kStageConvert);
+    Mat proxy;
+    if (!readJpegScaled(in_path, scale_denom, proxy, &mem))
+        return false;
+
+    CDEStats analysis;
+    CDECurve curve;
+    bool enhanced = cde.computeTransform(proxy, curve, &analysis);
+    mem.nest(analysis.memory);
+    mem.release(matBytes(proxy));
+    proxy.release();
+    if (stats) {
+        *stats = analysis;
+        stats->memory = mem;
+    }
+
+    if (!enhanced) {
+        bool copied = copyFile(in_path, out_path);
+        if (stats)
+            stats->total_ms = elapsedMs(start);
+        return copied;
+    }
+    Mat lut = curve.toLUT();
+
+    // phase 2: full-resolution decode streamed into the encoder
+    FILE *in_file = std::fopen(in_path.c_str(), "rb");
+    if (!in_file)
+        return false;
+    std::string tmp_path = tempPath(out_path);
+    FILE *out_file = std::fopen(tmp_path.c_str(), "wb");
+    if (!out_file) {
+        std::fclose(in_file);
+        return false;
+    }
+
+    jpeg_decompress_struct dinfo;
+    jpeg_compress_struct cinfo;
+    ErrorManager derr, cerr;
+    bool gray = false;
+    bool ok = openDecompress(&dinfo, &derr, in_file, 1, &gray);
+    if (ok)
+        ok = openCompress(&cinfo, &cerr, out_file, dinfo.output_width, dinfo.output_height, gray, quality);
+    else
+        std::memset(&cinfo, 0, sizeof(cinfo));
+
+    if (ok) {
+        Mat strip_buf(kStripRows, dinfo.output_width, gray ? CV_8UC1 : CV_8UC3);
+        mem.enterStage(kStageApply);
+        mem.allocate(matBytes(strip_buf));
+        JSAMPROW rows[kStripRows];
+        for (int i = 0; ok && i < (int)dinfo.output_height; i += kStripRows) {
+            int n = std::min(kStripRows, (int)dinfo.output_height - i);
+            for (int r = 0; r < n; r++)
+                rows[r] = strip_buf.ptr<uchar>(r);
+            ok = readRows(&dinfo, &derr, rows, n);
+            if (!ok)
+                break;
+
+            Mat strip = strip_buf.rowRange(0, n);
+            transformStrip(strip, curve, lut, mem);
+            for (int r = 0; r < n; r++)
+                rows[r] = strip.ptr<uchar>(r);
+            ok = writeRows(&cinfo, &cerr, rows, n);
+        }
+        ok = ok && finishCompress(&cinfo, &cerr) && finishDecompress(&dinfo, &derr);
+    }
+
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+    std::fclose(out_file);
+    std::fclose(in_file);
+    if (!ok) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    if (!commitTemp(tmp_path, out_path))
+        return false;
+
+    if (stats) {
+        stats->memory = mem;
+        stats->total_ms = elapsedMs(start);
+    }
+    return true;
+}
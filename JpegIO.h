@@ -0,0 +1,31 @@
+//
+//  JpegIO.h
+//  Channel Division based Enhancement
+//
+//  Two-phase JPEG front end: statistics from a reduced-scale decode, then a
+//  single full-resolution decode streamed through the curve into the encoder.
+//
+
+#ifndef __CDE_JPEG_IO__
+#define __CDE_JPEG_IO__
+
+#include <string>
+#include <opencv2/core/core.hpp>
+#include "CDE.h"
+
+// Decodes a JPEG file to BGR at 1/scale_denom of its size, using the DCT scaling
+// of libjpeg. scale_denom is one of 1, 2, 4, 8. Returns false on any error.
+bool readJpegScaled(const std::string &path, int scale_denom, cv::Mat &bgr_img, CDEMemoryStats *mem = nullptr);
+
+// Enhances a JPEG file without holding the full-resolution image in memory.
+// The curve is computed on a 1/scale_denom decode, then the file is decoded
+// again at full resolution a strip at a time, mapped through the curve and
+// handed to the encoder. If the pre-scan skips the image, the input file is
+// copied as is. The result is written to a temporary file beside out_path and
+// renamed over it on success, so in_path and out_path may be the same file.
+// Returns false if either file cannot be handled, e.g. a non-JPEG input, in
+// which case out_path is untouched and the caller should fall back to cv::imread().
+bool enhanceJpegFile(CDE &cde, const std::string &in_path, const std::string &out_path,
+                     int scale_denom = 4, int quality = 95, CDEStats *stats = nullptr);
+
+#endif /* defined(__CDE_JPEG_IO__) */
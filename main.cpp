@@ -7,13 +7,41 @@
 
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <cctype>
 #include <opencv2/opencv.hpp>
 #include "CDE.h"
+#include "CDECurve.h"
+#include "GraphUtils.h"
+#include "JpegIO.h"
 
 using namespace std;
 using namespace cv;
 
+static bool hasJpegExtension(const string &path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == string::npos)
+        return false;
+    string ext = path.substr(dot + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "jpg" || ext == "jpeg";
+}
+
 int main(int argc, char * argv[]) {
+    // batch mode: ./CDE <input> <output>
+    if (argc == 3) {
+        CDE cde;
+        if (hasJpegExtension(argv[2]) && enhanceJpegFile(cde, argv[1], argv[2]))
+            return 0;
+
+        Mat in_img = imread(argv[1]);
+        if (in_img.empty())
+            return 1;
+        Mat out_img;
+        cde.enhance(in_img, out_img);
+        return imwrite(argv[2], out_img) ? 0 : 1;
+    }
+
     string img_name;
     cout<<"Please provide the path to the input image: ";
     cin>>img_name;
@@ -22,8 +50,14 @@ int main(int argc, char * argv[]) {
     Mat in_img = imread(img_name);
     Mat out_img;
     CDE cde;
-    cde.enhance(in_img, out_img);
+    CDECurve curve;
+    cde.computeTransform(in_img, curve);
+    CDE::applyTransform(in_img, curve, out_img);
 
+    vector<float> curve_values(curve.getFunc().val, curve.getFunc().val + kMaxIntensity + 1);
+    Mat background;
+    int graph_size = 2 * (kMaxIntensity + 1) + 40;
+    imshow("Transform function", drawFloatGraph(curve_values, background, 0.f, 1.f, graph_size, graph_size));
     imshow("Input", in_img);
     imshow("Output", out_img);
     waitKey(0);